@@ -0,0 +1,241 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include "log.hpp"
+
+namespace ns_admission
+{
+
+    typedef std::chrono::steady_clock Clock;
+
+    enum Admit
+    {
+        ADMITTED,   // full answer
+        DEGRADED,   // answer without snippets and with a smaller K
+        REJECTED    // no answer, tell client to retry later
+    };
+
+    // when the job now run by this worker thread was queued, set by the server's task queue,
+    // so the time a request waited for a worker counts in its deadline
+    class JobClock
+    {
+    private:
+        struct Job
+        {
+            Clock::time_point enqueue;
+            Clock::time_point start;
+            bool shed;      // queue was full or job was already too old when a worker took it
+            bool answered;  // a request of the job's connection was already answered
+        };
+
+        static Job &Current()
+        {
+            static thread_local Job job = {Clock::time_point(), Clock::time_point(), false, true};
+            return job;
+        }
+
+    public:
+        // worker thread, right before running a job
+        static void Start(const Clock::time_point &enqueue, bool shed)
+        {
+            Job &job = Current();
+            job.enqueue = enqueue;
+            job.start = Clock::now();
+            job.shed = shed;
+            job.answered = false;
+        }
+
+        // after every request of the job, static files included (server's logger)
+        static void Done()
+        {
+            Current().answered = true;
+        }
+
+        // arrival of the request being handled: the first request of a connection is charged the time its job
+        // waited in the queue (not the time an idle socket waited for its first bytes), later keep-alive
+        // requests arrive now
+        // returns true if the request should be shed without any work, for every request of a shed job
+        static bool Arrival(Clock::time_point *arrive)
+        {
+            Job &job = Current();
+            Clock::time_point now = Clock::now();
+            *arrive = job.answered ? now : now - (job.start - job.enqueue);
+            return job.shed;
+        }
+    };
+
+    // bounds how many searches run at the same time, waiting requests give up at their deadline
+    // instead of timing out on client side
+    class AdmissionController
+    {
+    private:
+        const int max_active;           // searches evaluated at the same time
+        const size_t degrade_backlog;   // waiting requests above this are degraded
+        int active;
+        int queued;
+        std::mutex mtx;
+        std::condition_variable cond;
+
+    public:
+        AdmissionController(int max_active_, size_t degrade_backlog_)
+            : max_active(max_active_), degrade_backlog(degrade_backlog_), active(0), queued(0)
+        {}
+        AdmissionController(const AdmissionController&) = delete;
+        AdmissionController& operator=(const AdmissionController&) = delete;
+
+    public:
+        // wait for a slot until deadline, caller must Release() if not REJECTED (see Slot)
+        // backlog: jobs still waiting for a worker in the server's task queue
+        Admit Acquire(const Clock::time_point &deadline, const Clock::time_point &arrive, size_t backlog)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if(Clock::now() >= deadline)
+            {
+                return REJECTED; // too late, client is going to give up anyway
+            }
+
+            queued++;
+            bool got = cond.wait_until(lock, deadline, [this](){ return active < max_active; });
+            queued--;
+            if(!got)
+            {
+                return REJECTED;
+            }
+            active++;
+
+            // waited more than half of the budget or lots of work behind us: answer cheaply
+            if(backlog + queued > degrade_backlog || Clock::now() - arrive > (deadline - arrive) / 2)
+            {
+                return DEGRADED;
+            }
+            return ADMITTED;
+        }
+
+        void Release()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                active--;
+            }
+            cond.notify_one();
+        }
+    };
+
+    // releases an admitted slot when leaving scope, also when the search throws
+    class Slot
+    {
+    private:
+        AdmissionController *admission;
+
+    public:
+        explicit Slot(AdmissionController *admission_) : admission(admission_) {}
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+        ~Slot() { admission->Release(); }
+    };
+
+    // identical queries in flight share one evaluation
+    class QueryCoalescer
+    {
+    private:
+        struct Flight
+        {
+            bool done;
+            Admit admit;
+            std::string json_string;
+            std::mutex mtx;
+            std::condition_variable cond;
+            Flight() : done(false), admit(REJECTED) {}
+        };
+
+        // leader's side of a flight: when leaving scope (also by exception) the flight is removed
+        // and its waiters are woken up, with REJECTED if the evaluation did not finish
+        class Landing
+        {
+        private:
+            QueryCoalescer *coalescer;
+            const std::string &query;
+            std::shared_ptr<Flight> flight;
+
+        public:
+            Admit admit;
+            std::string result;
+
+            Landing(QueryCoalescer *coalescer_, const std::string &query_, const std::shared_ptr<Flight> &flight_)
+                : coalescer(coalescer_), query(query_), flight(flight_), admit(REJECTED)
+            {}
+            Landing(const Landing&) = delete;
+            Landing& operator=(const Landing&) = delete;
+
+            ~Landing()
+            {
+                {
+                    // remove it first, so later arrivals start a fresh evaluation
+                    std::lock_guard<std::mutex> lock(coalescer->mtx);
+                    coalescer->flights.erase(query);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(flight->mtx);
+                    flight->admit = admit;
+                    flight->json_string = std::move(result);
+                    flight->done = true;
+                }
+                flight->cond.notify_all();
+            }
+        };
+
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+        std::mutex mtx;
+
+    public:
+        QueryCoalescer() {}
+        QueryCoalescer(const QueryCoalescer&) = delete;
+        QueryCoalescer& operator=(const QueryCoalescer&) = delete;
+
+    public:
+        // the first caller of a query runs eval, others wait for its result until their deadline
+        // eval: fills json_string and returns how it was admitted
+        Admit Do(const std::string &query, const Clock::time_point &deadline,
+                 const std::function<Admit(std::string *)> &eval, std::string *json_string)
+        {
+            std::shared_ptr<Flight> flight;
+            bool leader = false;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                auto iter = flights.find(query);
+                if(iter == flights.end())
+                {
+                    flight = std::make_shared<Flight>();
+                    flights[query] = flight;
+                    leader = true;
+                }
+                else
+                {
+                    flight = iter->second;
+                }
+            }
+
+            if(!leader)
+            {
+                std::unique_lock<std::mutex> lock(flight->mtx);
+                if(!flight->cond.wait_until(lock, deadline, [&flight](){ return flight->done; }))
+                {
+                    return REJECTED;
+                }
+                *json_string = flight->json_string;
+                return flight->admit;
+            }
+
+            Landing landing(this, query, flight);
+            landing.admit = eval(&landing.result);
+            *json_string = landing.result;
+            return landing.admit;
+        }
+    };
+}
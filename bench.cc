@@ -0,0 +1,243 @@
+#include "searcher.hpp"
+#include "numa.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <json/json.h>
+
+// search latency of the in-memory index, to compare placements before/after on one machine
+// ./bench <queries.txt> [threads] [seconds] [local|interleave|replicate] [huge] [input|url|cluster] [nodedup]
+// e.g.  ./bench queries.txt 32 30 local
+//       ./bench queries.txt 32 30 replicate huge
+//       ./bench queries.txt 1 30 local cluster     doc_id order, see ns_index::DocOrder
+//       ./bench queries.txt 1 30 local nodedup     near-duplicate docs kept, compare candidates_per_query
+
+const std::string input = "data/raw_html/raw.txt";
+
+// latencies in fixed memory: 16 linear buckets per power of two of nanoseconds, within ~6% of the real value
+class LatencyHistogram
+{
+private:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;
+    std::vector<uint64_t> buckets;
+    uint64_t count;
+
+    static int Bucket(uint64_t ns)
+    {
+        if(ns < (uint64_t)SUB)
+        {
+            return (int)ns;
+        }
+        int msb = 63 - __builtin_clzll(ns);
+        int shift = msb - SUB_BITS;
+        return SUB + shift * SUB + (int)((ns >> shift) & (SUB - 1));
+    }
+
+    // middle of bucket, ns
+    static double Value(int bucket)
+    {
+        if(bucket < SUB)
+        {
+            return bucket;
+        }
+        int shift = (bucket - SUB) / SUB;
+        int sub = (bucket - SUB) % SUB;
+        return ((double)(SUB + sub) + 0.5) * (double)(1ULL << shift);
+    }
+
+public:
+    LatencyHistogram() : buckets(SUB + (64 - SUB_BITS) * SUB, 0), count(0) {}
+
+    void Add(uint64_t ns)
+    {
+        buckets[Bucket(ns)]++;
+        count++;
+    }
+
+    void Merge(const LatencyHistogram &other)
+    {
+        for(std::size_t i = 0; i < buckets.size(); i++)
+        {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+    }
+
+    uint64_t Count() const { return count; }
+
+    // percent in [0, 100], microseconds
+    double Percentile(double percent) const
+    {
+        uint64_t rank = (uint64_t)(percent / 100 * (count - 1));
+        uint64_t seen = 0;
+        for(std::size_t i = 0; i < buckets.size(); i++)
+        {
+            seen += buckets[i];
+            if(seen > rank)
+            {
+                return Value((int)i) / 1000;
+            }
+        }
+        return 0;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const std::string usage = " <queries.txt> [threads] [seconds] [local|interleave|replicate] [huge] [input|url|cluster] [nodedup]";
+    if(argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << usage << std::endl;
+        return 1;
+    }
+    int threads_num = argc > 2 ? std::atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+    int seconds = argc > 3 ? std::atoi(argv[3]) : 10;
+    // placement, "huge", doc order and "nodedup" are told apart by name, each of them is optional
+    std::string placement_name = "local", order_name = "url";
+    ns_numa::Placement placement = ns_numa::PLACE_LOCAL;
+    ns_index::DocOrder order = ns_index::ORDER_URL;
+    bool huge_pages = false;
+    bool dedup = true;
+    for(int i = 4; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(ns_numa::NumaUtil::ParsePlacement(arg, &placement))
+        {
+            placement_name = arg;
+        }
+        else if(ns_index::Index::ParseDocOrder(arg, &order))
+        {
+            order_name = arg;
+        }
+        else if(arg == "huge")
+        {
+            huge_pages = true;
+        }
+        else if(arg == "nodedup")
+        {
+            dedup = false;
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << usage << std::endl;
+            return 1;
+        }
+    }
+    if(threads_num <= 0)
+    {
+        threads_num = 1;
+    }
+
+    std::vector<std::string> queries;
+    std::ifstream in(argv[1]);
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(!line.empty())
+        {
+            queries.push_back(line);
+        }
+    }
+    if(queries.empty())
+    {
+        std::cerr << "no query in " << argv[1] << std::endl;
+        return 1;
+    }
+
+    // LOG writes to std::cout, keep stdout for json only
+    std::streambuf *cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+    ns_searcher::Searcher search;
+    search.InitSearcher(input, order, placement, huge_pages, dedup);
+
+    // docs every query has to weigh and sort, dropped by dedup
+    std::vector<uint64_t> candidates;
+    for(const std::string &query : queries)
+    {
+        candidates.push_back(search.Candidates(query));
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // threads are pinned round-robin to nodes only with PLACE_REPLICATE, like http_server's workers,
+    // so every placement is measured the way the server runs it
+    std::vector<int> nodes = ns_numa::NumaUtil::Nodes();
+    bool pin = placement == ns_numa::PLACE_REPLICATE;
+    std::vector<LatencyHistogram> latencies(threads_num); // written once by each thread when it stops
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < threads_num; i++)
+    {
+        threads.emplace_back([&, i](){
+            if(pin)
+            {
+                ns_numa::NumaUtil::Pin(nodes[i % nodes.size()]);
+            }
+            // local to the thread (allocated after pinning, on its own node): histograms next to each other
+            // in latencies would share a cache line written by every Add, across sockets
+            LatencyHistogram local;
+            std::string json_string;
+            for(std::size_t q = i; !stop; q++)
+            {
+                auto start = std::chrono::steady_clock::now();
+                search.Search(queries[q % queries.size()], &json_string);
+                auto cost = std::chrono::steady_clock::now() - start;
+                local.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(cost).count());
+            }
+            latencies[i] = std::move(local);
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for(std::thread &t : threads)
+    {
+        t.join();
+    }
+    std::cout.rdbuf(cout_buf);
+
+    LatencyHistogram all;
+    for(const LatencyHistogram &l : latencies)
+    {
+        all.Merge(l);
+    }
+
+    Json::Value root;
+    root["placement"] = placement_name;
+    root["order"] = order_name;
+    root["dedup"] = dedup;
+    root["huge_pages"] = huge_pages;
+    root["nodes"] = (Json::UInt64)nodes.size();
+    root["threads"] = threads_num;
+    root["seconds"] = seconds;
+    root["pinned"] = pin;
+    root["searches"] = (Json::UInt64)all.Count();
+    root["qps"] = (double)all.Count() / seconds;
+    const double percents[] = {50, 90, 99, 99.9};
+    const char *names[] = {"p50_us", "p90_us", "p99_us", "p999_us"};
+    for(int i = 0; i < 4 && all.Count() > 0; i++)
+    {
+        root[names[i]] = all.Percentile(percents[i]);
+    }
+
+    uint64_t candidates_sum = 0;
+    for(uint64_t c : candidates)
+    {
+        candidates_sum += c;
+    }
+    Json::Value candidates_per_query;
+    candidates_per_query["mean"] = (double)candidates_sum / candidates.size();
+    candidates_per_query["p50"] = (Json::UInt64)candidates[(candidates.size() - 1) / 2];
+    candidates_per_query["p99"] = (Json::UInt64)candidates[(std::size_t)(0.99 * (candidates.size() - 1))];
+    candidates_per_query["max"] = (Json::UInt64)candidates.back();
+    root["candidates_per_query"] = candidates_per_query;
+
+    Json::StyledWriter writer;
+    std::cout << writer.write(root);
+    return 0;
+}
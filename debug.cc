@@ -3,14 +3,25 @@
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <chrono>
 
 const std::string input = "data/raw_html/raw.txt";
 
-int main()
+// ./debug [input|url|cluster] [nodedup]   doc_id order (see ns_index::DocOrder), keep near-duplicate docs
+int main(int argc, char *argv[])
 {
+    ns_index::DocOrder order = ns_index::ORDER_URL;
+    if((argc > 1 && !ns_index::Index::ParseDocOrder(argv[1], &order))
+       || (argc > 2 && std::string(argv[2]) != "nodedup"))
+    {
+        std::cerr << "usage: " << argv[0] << " [input|url|cluster] [nodedup]" << std::endl;
+        return 1;
+    }
+    bool dedup = argc <= 2;
+
     // for test
     ns_searcher::Searcher *search = new ns_searcher::Searcher();
-    search->InitSearcher(input);
+    search->InitSearcher(input, order, ns_numa::PLACE_LOCAL, false, dedup);
 
     std::string query;
     std::string json_string;
@@ -18,8 +29,11 @@ int main()
     {
         std::cout << "Please Enter Your Search Query# ";
         getline(std::cin, query);
+        auto start = std::chrono::steady_clock::now();
         search->Search(query, &json_string);
+        auto cost = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
         std::cout << json_string<< std::endl;
+        std::cout << "search cost: " << cost.count() << "us, candidates: " << search->Candidates(query) << std::endl;
     }
     return 0;
 }
\ No newline at end of file
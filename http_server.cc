@@ -1,18 +1,175 @@
 #include "cpp-httplib-v0.7.15/httplib.h"
 #include "searcher.hpp"
+#include "admission.hpp"
+#include "numa.hpp"
 #include "util.hpp"
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <thread>
 
 const std::string input = "data/raw_html/raw.txt";
 const std::string root_path = "./wwwroot";
 
-int main()
+// admission control, see admission.hpp; the limits follow httplib's pool size in main()
+const int deadline_ms = 500;           // budget of one search request, time in the task queue included
+const size_t degraded_top_k = 10;      // docs returned by a degraded answer
+
+// httplib's thread pool with a bounded queue:
+// - every job is timestamped when queued, the handler takes it as the request's arrival (see JobClock)
+// - jobs above max_backlog, or already past the deadline when a worker takes them, are shed:
+//   they still run (httplib's job owns the socket) but every /s on them answers 503 with Connection: close,
+//   and they are taken before normal jobs since they are cheap
+// - shed jobs are bounded by max_backlog too, above it the listening thread waits, so new connections
+//   stay in the kernel's accept backlog instead of growing memory here
+// - with pin, worker i is pinned to the i-th NUMA node (round-robin),
+//   so with PLACE_REPLICATE every search reads the index replica of its own node
+class ServerTaskQueue : public httplib::TaskQueue
 {
+private:
+    struct Job
+    {
+        std::function<void()> fn;
+        ns_admission::Clock::time_point enqueue;
+    };
+
+    const size_t max_backlog;
+    std::atomic<size_t> &backlog;   // jobs in normal queue, read by the handler
+    std::vector<std::thread> workers;
+    std::deque<Job> jobs;
+    std::deque<Job> shed_jobs;
+    bool stop;
+    std::mutex mtx;
+    std::condition_variable cond;       // a job to run
+    std::condition_variable shed_room;  // room in shed_jobs
+
+public:
+    ServerTaskQueue(size_t n, size_t max_backlog_, std::atomic<size_t> &backlog_, bool pin)
+        : max_backlog(max_backlog_), backlog(backlog_), stop(false)
+    {
+        std::vector<int> nodes = ns_numa::NumaUtil::Nodes();
+        for(size_t i = 0; i < n; i++)
+        {
+            int node = nodes[i % nodes.size()];
+            workers.emplace_back([this, node, pin](){
+                if(pin)
+                {
+                    ns_numa::NumaUtil::Pin(node);
+                }
+                Work();
+            });
+        }
+    }
+    ServerTaskQueue(const ServerTaskQueue&) = delete;
+
+    void enqueue(std::function<void()> fn) override
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            Job job = {std::move(fn), ns_admission::Clock::now()};
+            if(jobs.size() >= max_backlog)
+            {
+                shed_room.wait(lock, [this](){ return stop || shed_jobs.size() < max_backlog; });
+                shed_jobs.push_back(std::move(job));
+            }
+            else
+            {
+                jobs.push_back(std::move(job));
+                backlog = jobs.size();
+            }
+        }
+        cond.notify_one();
+    }
+
+    void shutdown() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cond.notify_all();
+        shed_room.notify_all();
+        for(std::thread &t : workers)
+        {
+            t.join();
+        }
+    }
+
+private:
+    void Work()
+    {
+        while(true)
+        {
+            Job job;
+            bool shed = true;
+            bool room = false;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cond.wait(lock, [this](){ return stop || !jobs.empty() || !shed_jobs.empty(); });
+                if(!shed_jobs.empty())
+                {
+                    job = std::move(shed_jobs.front());
+                    shed_jobs.pop_front();
+                    room = true;
+                }
+                else if(!jobs.empty())
+                {
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                    backlog = jobs.size();
+                    shed = ns_admission::Clock::now() - job.enqueue > std::chrono::milliseconds(deadline_ms);
+                }
+                else
+                {
+                    return; // stop and nothing left
+                }
+            }
+            if(room)
+            {
+                shed_room.notify_one();
+            }
+            ns_admission::JobClock::Start(job.enqueue, shed);
+            job.fn();
+        }
+    }
+};
+
+// ./http_server [local|interleave|replicate] [huge]
+int main(int argc, char *argv[])
+{
+    ns_numa::Placement placement = ns_numa::PLACE_LOCAL;
+    if(argc > 1 && !ns_numa::NumaUtil::ParsePlacement(argv[1], &placement))
+    {
+        std::cerr << "usage: " << argv[0] << " [local|interleave|replicate] [huge]" << std::endl;
+        return 1;
+    }
+    bool huge_pages = argc > 2 && std::string(argv[2]) == "huge";
+
     ns_searcher::Searcher search;
-    search.InitSearcher(input);
+    search.InitSearcher(input, ns_index::ORDER_URL, placement, huge_pages);
+
+    // limits follow the pool: one search per core, the other workers stay free for 503s and static files
+    const size_t pool_size = CPPHTTPLIB_THREAD_POOL_COUNT;
+    const int cores = std::max(1u, std::thread::hardware_concurrency());
+    const int max_active = std::max(1, std::min(cores, (int)pool_size - 1)); // searches evaluated at the same time
+    const size_t max_backlog = pool_size * 4;    // jobs waiting for a worker, more than it are shed
+    const size_t degrade_backlog = pool_size;    // waiting jobs above it get degraded answer
+
+    ns_admission::AdmissionController admission(max_active, degrade_backlog);
+    ns_admission::QueryCoalescer coalescer;
+    std::atomic<size_t> backlog(0);
 
     httplib::Server svr;
     svr.set_base_dir(root_path.c_str());
-    svr.Get("/s", [&search](const httplib::Request &req,  httplib::Response &rsp){
+    bool pin = placement == ns_numa::PLACE_REPLICATE;
+    svr.new_task_queue = [pool_size, max_backlog, &backlog, pin](){
+        return new ServerTaskQueue(pool_size, max_backlog, backlog, pin);
+    };
+    // every answered request, static files too, so only the first request of a connection is charged its queue time
+    svr.set_logger([](const httplib::Request &, const httplib::Response &){
+        ns_admission::JobClock::Done();
+    });
+    svr.Get("/s", [&search, &admission, &coalescer, &backlog](const httplib::Request &req,  httplib::Response &rsp){
         if(!req.has_param("word"))
         {
             rsp.set_content("Please enter key-words to search", "text/plain; charset=utf-8");
@@ -21,12 +178,47 @@ int main()
         std::string word = req.get_param_value("word");
         // std::cout << "user is searching: " << word << std::endl;
         LOG(NORMAL, "user searched: " + word);
+
+        ns_admission::Clock::time_point arrive;
+        bool shed = ns_admission::JobClock::Arrival(&arrive);
+        auto deadline = arrive + std::chrono::milliseconds(deadline_ms);
         std::string json_string;
-        search.Search(word, &json_string);
+        ns_admission::Admit admit = shed ? ns_admission::REJECTED :
+                                    coalescer.Do(word, deadline, [&](std::string *out) -> ns_admission::Admit {
+            ns_admission::Admit a = admission.Acquire(deadline, arrive, backlog);
+            if(a == ns_admission::REJECTED)
+            {
+                return a;
+            }
+            ns_admission::Slot slot(&admission);
+            if(a == ns_admission::DEGRADED)
+            {
+                search.Search(word, out, degraded_top_k, false);
+            }
+            else
+            {
+                search.Search(word, out);
+            }
+            return a;
+        }, &json_string);
+
+        if(admit == ns_admission::REJECTED)
+        {
+            LOG(WARNING, "server overloaded, rejected: " + word);
+            rsp.status = 503;
+            rsp.set_header("Retry-After", "1");
+            rsp.set_header("Connection", "close"); // give the worker back instead of keeping the connection alive
+            rsp.set_content("Server is busy, please try again later", "text/plain; charset=utf-8");
+            return;
+        }
+        if(admit == ns_admission::DEGRADED)
+        {
+            LOG(WARNING, "server overloaded, degraded: " + word);
+        }
         rsp.set_content(json_string, "application/json");
     });
 
     LOG(NORMAL, "server started...");
     svr.listen("0.0.0.0", 8080);
     return 0;
-}
\ No newline at end of file
+}
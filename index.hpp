@@ -6,6 +6,9 @@
 #include <unordered_map>
 #include <fstream>
 #include <mutex>
+#include <algorithm>
+#include <functional>
+#include <cctype>
 #include "util.hpp"
 #include "log.hpp"
 
@@ -18,33 +21,44 @@ namespace ns_index
         std::string content;
         std::string url;
         uint64_t doc_id; // doc's id
+        std::vector<std::string> aliases; // urls of near-duplicate docs folded into this one
     };
 
     struct InvertedElem
     {
         uint64_t doc_id;
-        std::string word;
+        uint32_t term_id;   // word of this elem, see Index::GetTerm
         int weight;
-        InvertedElem():weight(0){}
+        InvertedElem():term_id(0), weight(0){}
     };
 
     // inverted_list
     typedef std::vector<InvertedElem> InvertedList;
 
+    // how BuildIndex assigns doc_ids
+    enum DocOrder
+    {
+        ORDER_INPUT,        // order of raw.txt, i.e. order of directory traversal in parser
+        ORDER_URL,          // sorted by url, docs of one library are next to each other
+        ORDER_URL_CLUSTER   // sorted by url, then docs of one directory chained by shared words
+    };
+
     class Index
     {
     private:
         // fowward_index uses the index of vector to be the index of the doc
         std::vector<DocInfo> forward_index;
-        // inverted_index: one key to one/many InvertedElem
-        std::unordered_map<std::string, InvertedList> inverted_index;
+        // terms: every word of the index interned to a term id
+        ns_util::TermDict terms;
+        // inverted_index: term id to one/many InvertedElem
+        std::vector<InvertedList> inverted_index;
 
         static Index* instance;
         static std::mutex mtx;
 
     private:
         Index() {}
-        Index(const Index&) = delete;
+        Index(const Index&) = default; // only for Replicate
         Index& operator=(const Index&) = delete;
 
     public:
@@ -65,6 +79,13 @@ namespace ns_index
             return instance;
         }
 
+        // deep copy of the whole index, its memory is placed by the memory policy of the calling thread
+        // (see ns_numa), used to put one replica on every NUMA node
+        Index *Replicate() const
+        {
+            return new Index(*this);
+        }
+
         // use doc_id to find doc
         DocInfo *GetForwardIndex(uint64_t doc_id)
         {
@@ -76,20 +97,89 @@ namespace ns_index
             return &forward_index[doc_id];
         }
 
+        // "input" / "url" / "cluster"
+        static bool ParseDocOrder(const std::string &name, DocOrder *order)
+        {
+            if (name == "input") *order = ORDER_INPUT;
+            else if (name == "url") *order = ORDER_URL;
+            else if (name == "cluster") *order = ORDER_URL_CLUSTER;
+            else return false;
+            return true;
+        }
+
+        // memory blocks holding the index: forward_index and its strings, term pool, posting vectors
+        // (hugepage advice is limited to them, see ns_numa::NumaUtil::AdviseHugePages)
+        void MemoryRegions(std::vector<ns_util::MemoryRegion> *regions) const
+        {
+            regions->push_back(ns_util::MemoryRegion(forward_index.data(), forward_index.capacity() * sizeof(DocInfo)));
+            for (const DocInfo &doc : forward_index)
+            {
+                StringRegion(doc.title, regions);
+                StringRegion(doc.content, regions);
+                StringRegion(doc.url, regions);
+                for (const std::string &alias : doc.aliases)
+                {
+                    StringRegion(alias, regions);
+                }
+            }
+            terms.MemoryRegions(regions);
+            regions->push_back(ns_util::MemoryRegion(inverted_index.data(), inverted_index.capacity() * sizeof(InvertedList)));
+            for (const InvertedList &list : inverted_index)
+            {
+                regions->push_back(ns_util::MemoryRegion(list.data(), list.capacity() * sizeof(InvertedElem)));
+            }
+        }
+
+        // whole forward_index, for statistics
+        const std::vector<DocInfo> &GetForwardIndexAll() const
+        {
+            return forward_index;
+        }
+
+        // whole inverted_index, indexed by term id, for statistics
+        const std::vector<InvertedList> &GetInvertedIndexAll() const
+        {
+            return inverted_index;
+        }
+
+        // all terms, for statistics
+        const ns_util::TermDict &GetTermsAll() const
+        {
+            return terms;
+        }
+
+        // word of a term id
+        std::string GetTerm(uint32_t term_id) const
+        {
+            return terms.Term(term_id);
+        }
+
         // use string to find inverted_list
         InvertedList *GetInvertedList(const std::string &word)
         {
-            auto iter = inverted_index.find(word);
-            if (iter == inverted_index.end())
+            uint32_t term_id = terms.Find(word.data(), word.size());
+            if (term_id == ns_util::TermDict::NOT_FOUND)
             {
                 std::cerr << word << "is not in InvertedList" << std::endl;
                 return nullptr;
             }
-            return &(iter->second);
+            return &inverted_index[term_id];
+        }
+
+        // inverted_list of a term id, see ns_util::JiebaUtil::FindStringIds
+        InvertedList *GetInvertedList(uint32_t term_id)
+        {
+            if (term_id >= inverted_index.size())
+            {
+                return nullptr;
+            }
+            return &inverted_index[term_id];
         }
 
         // use off-labelled file (./data/raw_html/raw.txt) to build forward_index and inverted_index
-        bool BuildIndex(const std::string &input) // input parsed data
+        // order: how doc_ids are assigned, see DocOrder
+        // dedup: keep only one doc of every group of near-duplicate docs, see RemoveDuplicates
+        bool BuildIndex(const std::string &input, DocOrder order = ORDER_URL, bool dedup = true) // input parsed data
         {
             std::ifstream in(input, std::ios::in | std::ios::binary);
             if (!in.is_open())
@@ -98,8 +188,8 @@ namespace ns_index
                 return false;
             }
 
+            // 1.load every doc first, doc_ids are given after reordering
             std::string line;
-            int count = 0;
             while (std::getline(in, line))
             {
                 DocInfo *doc = BuildForwardIndex(line);
@@ -108,8 +198,23 @@ namespace ns_index
                     std::cerr << "build " << line << "error" << std::endl; // for debug
                     continue;
                 }
+            }
 
-                BuildInvertedIndex(*doc);
+            // 2.fold near-duplicate docs into one canonical doc
+            if (dedup)
+            {
+                RemoveDuplicates();
+            }
+
+            // 3.reorder docs, input_ids[new doc_id] = position in input
+            std::vector<uint64_t> input_ids;
+            ReorderDocs(order, &input_ids);
+
+            // 4.build inverted_index in doc_id order, so every InvertedList is sorted by doc_id
+            int count = 0;
+            for (DocInfo &doc : forward_index)
+            {
+                BuildInvertedIndex(doc);
 
                 count++;
                 // if(count % 50 == 0)
@@ -118,6 +223,8 @@ namespace ns_index
                 // }
                 LOG(NORMAL, "Currently built index docs: " + std::to_string(count));
             }
+
+            ReportGaps(input_ids);
             return true;
         }
 
@@ -138,16 +245,390 @@ namespace ns_index
             doc.title = results[0];            // titile
             doc.content = results[1];          // content
             doc.url = results[2];              // url
-            doc.doc_id = forward_index.size(); // set the id before insert
+            doc.doc_id = forward_index.size(); // set the id before insert, reset by ReorderDocs
             // insert into forward index
             forward_index.push_back(std::move(doc));
             return &forward_index.back();
         }
 
+        // versioned copies, reference/synopsis duplicates and redirect stubs are near-identical,
+        // find them by SimHash + banded LSH, keep the doc with the shortest url and record others as aliases
+        void RemoveDuplicates()
+        {
+            const int max_distance = 3;     // hamming distance of near-duplicates
+            const int bands = max_distance + 1; // 4 bands of 16 bits: near-duplicates must share one band
+            const int band_bits = 64 / bands;
+            const std::size_t max_bucket = 256; // bigger buckets only compare nearby hashes, see step 2
+            const std::size_t min_shingles = 16; // shorter docs are mostly shared header/footer, only folded when equal
+
+            std::size_t n = forward_index.size();
+            std::vector<uint64_t> hashes(n);
+            std::vector<bool> foldable(n);
+            std::unordered_map<std::string, std::vector<std::size_t>> short_docs; // text -> short docs, empty ones left out
+            for (std::size_t i = 0; i < n; i++)
+            {
+                std::string text = forward_index[i].title + " " + forward_index[i].content;
+                std::size_t shingles = 0;
+                hashes[i] = ns_util::HashUtil::SimHash(text, 3, &shingles);
+                foldable[i] = shingles >= min_shingles;
+                if (!foldable[i] && shingles > 0)
+                {
+                    short_docs[text].push_back(i);
+                }
+            }
+
+            // 1.bucket foldable docs by every band
+            std::unordered_map<uint64_t, std::vector<std::size_t>> buckets;
+            for (std::size_t i = 0; i < n; i++)
+            {
+                if (!foldable[i])
+                {
+                    continue;
+                }
+                for (int band = 0; band < bands; band++)
+                {
+                    uint64_t value = (hashes[i] >> (band * band_bits)) & ((1ULL << band_bits) - 1);
+                    buckets[((uint64_t)band << band_bits) | value].push_back(i);
+                }
+            }
+
+            // 2.near[doc]: docs of a shared bucket that are really close to it
+            std::vector<std::vector<std::size_t>> near(n);
+            auto prefer = [this](std::size_t a, std::size_t b){
+                return forward_index[a].url.size() < forward_index[b].url.size();
+            };
+            auto link = [&](std::size_t a, std::size_t b){
+                if (ns_util::HashUtil::HammingDistance(hashes[a], hashes[b]) <= max_distance)
+                {
+                    near[a].push_back(b);
+                    near[b].push_back(a);
+                }
+            };
+            for (auto &pair : buckets)
+            {
+                std::vector<std::size_t> &bucket = pair.second;
+                if (bucket.size() <= max_bucket)
+                {
+                    for (std::size_t i = 0; i < bucket.size(); i++)
+                    {
+                        for (std::size_t j = i + 1; j < bucket.size(); j++)
+                        {
+                            link(bucket[i], bucket[j]);
+                        }
+                    }
+                    continue;
+                }
+
+                // crowded bucket, all pairs is too slow: sort it once per other band with that band rotated to
+                // the top bits and compare only within a window, so docs equal on that band are neighbours.
+                // approximate: near-duplicates differing in every other band, or sharing a band with more than
+                // max_bucket docs, can be missed
+                int band = (int)(pair.first >> band_bits);
+                for (int other = 0; other < bands; other++)
+                {
+                    if (other == band)
+                    {
+                        continue;
+                    }
+                    int shift = 64 - (other + 1) * band_bits;
+                    auto key = [&hashes, shift](std::size_t doc){
+                        uint64_t h = hashes[doc];
+                        return shift == 0 ? h : (h << shift) | (h >> (64 - shift));
+                    };
+                    std::sort(bucket.begin(), bucket.end(), [&key](std::size_t a, std::size_t b){
+                        return key(a) < key(b);
+                    });
+                    for (std::size_t i = 0; i < bucket.size(); i++)
+                    {
+                        for (std::size_t j = i + 1; j < bucket.size() && j <= i + max_bucket; j++)
+                        {
+                            link(bucket[i], bucket[j]);
+                        }
+                    }
+                }
+            }
+
+            // short docs are near only to docs of the same text, linked to the preferred one of them (step 3)
+            for (auto &pair : short_docs)
+            {
+                std::vector<std::size_t> &same = pair.second;
+                std::size_t best = *std::min_element(same.begin(), same.end(), prefer);
+                for (std::size_t doc : same)
+                {
+                    if (doc != best)
+                    {
+                        near[best].push_back(doc);
+                        near[doc].push_back(best);
+                    }
+                }
+            }
+
+            // 3.canonical docs in order of preference (shortest url, then first in input) claim their unclaimed
+            //   near docs, so every alias is itself within max_distance of its canonical doc: closeness is not
+            //   chained through other docs
+            std::vector<std::size_t> preferred(n);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                preferred[i] = i;
+            }
+            std::stable_sort(preferred.begin(), preferred.end(), prefer);
+            std::vector<std::size_t> canonical(n, n);
+            for (std::size_t i : preferred)
+            {
+                if (canonical[i] != n)
+                {
+                    continue;
+                }
+                canonical[i] = i;
+                for (std::size_t j : near[i])
+                {
+                    if (canonical[j] == n)
+                    {
+                        canonical[j] = i;
+                    }
+                }
+            }
+
+            // 4.keep canonical docs only
+            std::vector<DocInfo> kept;
+            std::vector<std::size_t> kept_pos(n, n);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                if (canonical[i] == i)
+                {
+                    kept_pos[i] = kept.size();
+                    kept.push_back(std::move(forward_index[i]));
+                }
+            }
+            for (std::size_t i = 0; i < n; i++)
+            {
+                if (canonical[i] != i)
+                {
+                    kept[kept_pos[canonical[i]]].aliases.push_back(std::move(forward_index[i].url));
+                }
+            }
+            for (std::size_t i = 0; i < kept.size(); i++)
+            {
+                kept[i].doc_id = i;
+            }
+            LOG(NORMAL, "near-duplicate docs removed: " + std::to_string(n - kept.size())
+                        + ", docs kept: " + std::to_string(kept.size()));
+            forward_index.swap(kept);
+        }
+
+        // heap buffer of s, short strings live inside the string object itself
+        static void StringRegion(const std::string &s, std::vector<ns_util::MemoryRegion> *regions)
+        {
+            const char *object = (const char *)&s;
+            if (s.data() < object || s.data() >= object + sizeof(s))
+            {
+                regions->push_back(ns_util::MemoryRegion(s.data(), s.capacity() + 1));
+            }
+        }
+
+        // directory part of url: ".../html/boost_asio/reference/foo.html" -> ".../html/boost_asio/reference/"
+        static std::string UrlDir(const std::string &url)
+        {
+            std::size_t pos = url.rfind('/');
+            return pos == std::string::npos ? std::string() : url.substr(0, pos + 1);
+        }
+
+        // hashed lower-case ascii words of title and head of content, used to cluster docs of one directory
+        static std::vector<std::size_t> Vocabulary(const DocInfo &doc)
+        {
+            const std::size_t content_head = 512;
+            std::string text = doc.title + " " + doc.content.substr(0, content_head);
+            std::vector<std::size_t> words;
+            std::string word;
+            std::hash<std::string> hasher;
+            for (std::size_t i = 0; i <= text.size(); i++)
+            {
+                if (i < text.size() && std::isalnum((unsigned char)text[i]))
+                {
+                    word += std::tolower((unsigned char)text[i]);
+                }
+                else if (!word.empty())
+                {
+                    words.push_back(hasher(word));
+                    word.clear();
+                }
+            }
+            std::sort(words.begin(), words.end());
+            words.erase(std::unique(words.begin(), words.end()), words.end());
+            return words;
+        }
+
+        static double Jaccard(const std::vector<std::size_t> &a, const std::vector<std::size_t> &b)
+        {
+            std::size_t i = 0, j = 0, same = 0;
+            while (i < a.size() && j < b.size())
+            {
+                if (a[i] < b[j]) i++;
+                else if (a[i] > b[j]) j++;
+                else { same++; i++; j++; }
+            }
+            std::size_t all = a.size() + b.size() - same;
+            return all == 0 ? 0.0 : (double)same / all;
+        }
+
+        // order one directory's docs: start from the first one, then always go to the most similar unvisited one
+        // among the first `window` unvisited docs in url order, so big directories cost O(n * window)
+        void ClusterDir(std::vector<uint64_t>::iterator begin, std::vector<uint64_t>::iterator end)
+        {
+            const std::size_t window = 256;
+            std::size_t n = end - begin;
+            if (n < 3)
+            {
+                return;
+            }
+            std::vector<std::vector<std::size_t>> vocab(n);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                vocab[i] = Vocabulary(forward_index[begin[i]]);
+            }
+
+            // unvisited docs as a linked list in url order, n is the end
+            std::vector<std::size_t> next(n), prev(n);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                next[i] = i + 1;
+                prev[i] = i == 0 ? n : i - 1;
+            }
+            std::size_t head = 0;
+
+            std::vector<uint64_t> chain;
+            chain.reserve(n);
+            std::size_t cur = 0;
+            while (cur != n)
+            {
+                // take cur out of the list
+                if (prev[cur] == n) head = next[cur];
+                else next[prev[cur]] = next[cur];
+                if (next[cur] != n) prev[next[cur]] = prev[cur];
+                chain.push_back(begin[cur]);
+
+                std::size_t best_doc = n;
+                double best = -1.0;
+                std::size_t seen = 0;
+                for (std::size_t i = head; i != n && seen < window; i = next[i], seen++)
+                {
+                    double sim = Jaccard(vocab[cur], vocab[i]);
+                    if (sim > best)
+                    {
+                        best = sim;
+                        best_doc = i;
+                    }
+                }
+                cur = best_doc;
+            }
+            std::copy(chain.begin(), chain.end(), begin);
+        }
+
+        // give doc_ids so that docs of one library (same url path) sit next to each other,
+        // this makes doc_id gaps in InvertedList smaller and traversal more local
+        void ReorderDocs(DocOrder order, std::vector<uint64_t> *input_ids)
+        {
+            std::vector<uint64_t> ids(forward_index.size());
+            for (std::size_t i = 0; i < ids.size(); i++)
+            {
+                ids[i] = i;
+            }
+
+            // sort by (directory, url), a plain url sort splits "dir/a.html dir/b/x.html dir/c.html" into two runs of dir/
+            std::vector<std::string> dirs(forward_index.size());
+            for (std::size_t i = 0; i < dirs.size(); i++)
+            {
+                dirs[i] = UrlDir(forward_index[i].url);
+            }
+            if (order != ORDER_INPUT)
+            {
+                std::stable_sort(ids.begin(), ids.end(), [this, &dirs](uint64_t a, uint64_t b){
+                    if (dirs[a] != dirs[b])
+                    {
+                        return dirs[a] < dirs[b];
+                    }
+                    return forward_index[a].url < forward_index[b].url;
+                });
+            }
+            if (order == ORDER_URL_CLUSTER)
+            {
+                auto begin = ids.begin();
+                while (begin != ids.end())
+                {
+                    auto end = begin;
+                    while (end != ids.end() && dirs[*end] == dirs[*begin])
+                    {
+                        end++;
+                    }
+                    ClusterDir(begin, end);
+                    begin = end;
+                }
+            }
+
+            std::vector<DocInfo> reordered;
+            reordered.reserve(forward_index.size());
+            for (uint64_t id : ids)
+            {
+                reordered.push_back(std::move(forward_index[id]));
+                reordered.back().doc_id = reordered.size() - 1;
+            }
+            forward_index.swap(reordered);
+            input_ids->swap(ids);
+        }
+
+        // cost of doc_id gaps if an InvertedList was stored as deltas:
+        // varint bytes and bare bit length of every gap
+        static void GapCost(std::vector<uint64_t> *doc_ids, uint64_t *varint_bytes, uint64_t *bits)
+        {
+            std::sort(doc_ids->begin(), doc_ids->end());
+            uint64_t prev = 0;
+            bool first = true;
+            for (uint64_t id : *doc_ids)
+            {
+                uint64_t gap = first ? id + 1 : id - prev;
+                first = false;
+                prev = id;
+                uint64_t len = 0;
+                for (uint64_t g = gap; g; g >>= 1)
+                {
+                    len++;
+                }
+                *bits += len;
+                *varint_bytes += len == 0 ? 1 : (len + 6) / 7;
+            }
+        }
+
+        // compare delta gaps of the chosen doc_id order with the input order
+        void ReportGaps(const std::vector<uint64_t> &input_ids)
+        {
+            uint64_t postings = 0;
+            uint64_t input_bytes = 0, input_bits = 0;
+            uint64_t reordered_bytes = 0, reordered_bits = 0;
+            std::vector<uint64_t> doc_ids;
+            for (const InvertedList &list : inverted_index)
+            {
+                doc_ids.clear();
+                for (const InvertedElem &elem : list)
+                {
+                    doc_ids.push_back(elem.doc_id);
+                }
+                GapCost(&doc_ids, &reordered_bytes, &reordered_bits);
+                for (uint64_t &id : doc_ids)
+                {
+                    id = input_ids[id];
+                }
+                GapCost(&doc_ids, &input_bytes, &input_bits);
+                postings += doc_ids.size();
+            }
+            LOG(NORMAL, "doc_id gaps of " + std::to_string(postings) + " postings"
+                        + ", input order: " + std::to_string(input_bytes) + " varint bytes, " + std::to_string(input_bits) + " bits"
+                        + ", reordered: " + std::to_string(reordered_bytes) + " varint bytes, " + std::to_string(reordered_bits) + " bits");
+        }
+
         bool BuildInvertedIndex(const DocInfo &doc)
         {
             // DocInfo{titile, content, url, doc_id}
-            // word -> inverted_index
+            // word -> term id -> inverted_index
             struct word_cnt
             {
                 int title_cnt;
@@ -155,41 +636,47 @@ namespace ns_index
 
                 word_cnt() :title_cnt(0), content_cnt(0) {}
             };
-            std::unordered_map<std::string, word_cnt> word_map; // store word <-> numbers it shows up
+            // word_cnts[term id]: numbers it shows up in this doc, doc_terms: term ids of this doc
+            static thread_local std::vector<uint32_t> title_ids, content_ids, doc_terms;
+            static thread_local std::vector<word_cnt> word_cnts;
+            title_ids.clear();
+            content_ids.clear();
+            doc_terms.clear();
 
-            // cut title
-            std::vector<std::string> title_words;
-            ns_util::JiebaUtil::CutString(doc.title, &title_words);
+            // cut title and content into index-wide term ids, lower-case for user search (hello/HELLO/Hello)
+            ns_util::JiebaUtil::CutStringToIds(doc.title, &terms, &title_ids, true);
+            ns_util::JiebaUtil::CutStringToIds(doc.content, &terms, &content_ids, true);
+            word_cnts.resize(terms.Size());
+            inverted_index.resize(terms.Size());
 
-            // count words in title
-            for(std::string s: title_words)
+            // count words in title and content
+            for(uint32_t id : title_ids)
             {
-                boost::to_lower(s); //for user search (hello/HELLO/Hello)
-                (word_map[s].title_cnt)++;
+                if(word_cnts[id].title_cnt == 0 && word_cnts[id].content_cnt == 0)
+                {
+                    doc_terms.push_back(id);
+                }
+                (word_cnts[id].title_cnt)++;
             }
-
-
-            // cut content
-            std::vector<std::string> content_words;
-            ns_util::JiebaUtil::CutString(doc.content, &content_words);
-
-
-            // count words in content
-            for(std::string s: content_words)
+            for(uint32_t id : content_ids)
             {
-                boost::to_lower(s);
-                (word_map[s].content_cnt)++;
+                if(word_cnts[id].title_cnt == 0 && word_cnts[id].content_cnt == 0)
+                {
+                    doc_terms.push_back(id);
+                }
+                (word_cnts[id].content_cnt)++;
             }
 
 #define X 10
 #define Y 1
-            for(auto &word_pair : word_map)
+            for(uint32_t id : doc_terms)
             {
                 InvertedElem item;
                 item.doc_id = doc.doc_id;
-                item.word = word_pair.first;
-                item.weight = X * word_pair.second.title_cnt + Y * word_pair.second.content_cnt;    //relativity
-                inverted_index[word_pair.first].push_back(std::move(item));
+                item.term_id = id;
+                item.weight = X * word_cnts[id].title_cnt + Y * word_cnts[id].content_cnt;    //relativity
+                inverted_index[id].push_back(item);
+                word_cnts[id] = word_cnt();
             }
 
             return true;
@@ -0,0 +1,279 @@
+#include "index.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <json/json.h>
+
+// build the index and print what it holds as json
+// ./index_stat [raw.txt] [top_n] [input|url|cluster] [nodedup] > data/index_stat.json
+
+const std::string default_input = "data/raw_html/raw.txt";
+const int default_top_n = 20;
+
+// memory is counted with libstdc++ layout (15 bytes SSO), malloc's own bookkeeping is not counted
+
+// heap bytes of a string, 0 when it is stored inside the string object itself
+static uint64_t StringHeap(const std::string &s)
+{
+    const std::size_t sso_capacity = 15;
+    return s.capacity() > sso_capacity ? s.capacity() + 1 : 0;
+}
+
+// min/max/mean/percentiles and power of 2 histogram of values
+static Json::Value Distribution(std::vector<uint64_t> values)
+{
+    Json::Value dist;
+    dist["count"] = (Json::UInt64)values.size();
+    if(values.empty())
+    {
+        return dist;
+    }
+    std::sort(values.begin(), values.end());
+    uint64_t sum = 0;
+    for(uint64_t v : values)
+    {
+        sum += v;
+    }
+    dist["min"] = (Json::UInt64)values.front();
+    dist["max"] = (Json::UInt64)values.back();
+    dist["mean"] = (double)sum / values.size();
+    const double percents[] = {50, 90, 99, 99.9};
+    const char *names[] = {"p50", "p90", "p99", "p999"};
+    for(int i = 0; i < 4; i++)
+    {
+        std::size_t pos = (std::size_t)(percents[i] / 100 * (values.size() - 1));
+        dist[names[i]] = (Json::UInt64)values[pos];
+    }
+
+    // bucket from 2^k holds values in [2^k, 2^(k+1)), bucket from 0 holds 0
+    std::map<int, uint64_t> buckets;
+    for(uint64_t v : values)
+    {
+        int k = -1;
+        for(uint64_t x = v; x; x >>= 1)
+        {
+            k++;
+        }
+        buckets[k]++;
+    }
+    Json::Value histogram(Json::arrayValue);
+    for(auto &pair : buckets)
+    {
+        Json::Value bucket;
+        bucket["from"] = (Json::UInt64)(pair.first < 0 ? 0 : 1ULL << pair.first);
+        bucket["count"] = (Json::UInt64)pair.second;
+        histogram.append(bucket);
+    }
+    dist["histogram"] = histogram;
+    return dist;
+}
+
+static Json::Value Memory(ns_index::Index *index)
+{
+    const std::vector<ns_index::DocInfo> &docs = index->GetForwardIndexAll();
+    const std::vector<ns_index::InvertedList> &inverted = index->GetInvertedIndexAll();
+
+    // 1.forward index
+    uint64_t doc_structs = docs.capacity() * sizeof(ns_index::DocInfo);
+    uint64_t titles = 0, contents = 0, urls = 0, aliases = 0;
+    for(const ns_index::DocInfo &doc : docs)
+    {
+        titles += StringHeap(doc.title);
+        contents += StringHeap(doc.content);
+        urls += StringHeap(doc.url);
+        aliases += doc.aliases.capacity() * sizeof(std::string);
+        for(const std::string &alias : doc.aliases)
+        {
+            aliases += StringHeap(alias);
+        }
+    }
+    Json::Value forward;
+    forward["doc_structs"] = (Json::UInt64)doc_structs;
+    forward["titles"] = (Json::UInt64)titles;
+    forward["contents"] = (Json::UInt64)contents;
+    forward["urls"] = (Json::UInt64)urls;
+    forward["aliases"] = (Json::UInt64)aliases;
+    forward["total"] = (Json::UInt64)(doc_structs + titles + contents + urls + aliases);
+
+    // 2.inverted index
+    const ns_util::TermDict &terms = index->GetTermsAll();
+    uint64_t list_structs = inverted.capacity() * sizeof(ns_index::InvertedList);
+    uint64_t term_strings = terms.PoolBytes();
+    uint64_t hash_table = terms.TableBytes();
+    uint64_t posting_vectors = 0, posting_slack = 0;
+    for(const ns_index::InvertedList &list : inverted)
+    {
+        posting_vectors += list.capacity() * sizeof(ns_index::InvertedElem);
+        posting_slack += (list.capacity() - list.size()) * sizeof(ns_index::InvertedElem);
+    }
+    Json::Value inverted_mem;
+    inverted_mem["list_structs"] = (Json::UInt64)list_structs;     // vector object of every term
+    inverted_mem["term_strings"] = (Json::UInt64)term_strings;     // TermDict pool
+    inverted_mem["posting_vectors"] = (Json::UInt64)posting_vectors;
+    inverted_mem["posting_vectors_slack"] = (Json::UInt64)posting_slack; // part of posting_vectors
+    inverted_mem["hash_table_overhead"] = (Json::UInt64)hash_table; // TermDict offsets + slots
+    inverted_mem["total"] = (Json::UInt64)(list_structs + term_strings + posting_vectors + hash_table);
+
+    Json::Value memory;
+    memory["forward_index"] = forward;
+    memory["inverted_index"] = inverted_mem;
+    memory["total"] = (Json::UInt64)(forward["total"].asUInt64() + inverted_mem["total"].asUInt64());
+    return memory;
+}
+
+static Json::Value Postings(ns_index::Index *index, int top_n)
+{
+    const std::vector<ns_index::InvertedList> &inverted = index->GetInvertedIndexAll();
+
+    std::vector<uint64_t> lengths;
+    std::vector<std::pair<uint64_t, uint32_t>> terms; // (postings, term id)
+    lengths.reserve(inverted.size());
+    terms.reserve(inverted.size());
+    for(uint32_t id = 0; id < inverted.size(); id++)
+    {
+        lengths.push_back(inverted[id].size());
+        terms.push_back(std::make_pair((uint64_t)inverted[id].size(), id));
+    }
+
+    std::size_t n = std::min<std::size_t>(top_n, terms.size());
+    std::partial_sort(terms.begin(), terms.begin() + n, terms.end(),
+                      [](const std::pair<uint64_t, uint32_t> &a, const std::pair<uint64_t, uint32_t> &b)
+                      {
+                          return a.first > b.first;
+                      });
+    Json::Value heaviest(Json::arrayValue);
+    for(std::size_t i = 0; i < n; i++)
+    {
+        Json::Value term;
+        term["term"] = index->GetTerm(terms[i].second);
+        term["postings"] = (Json::UInt64)terms[i].first;
+        term["bytes"] = (Json::UInt64)(terms[i].first * sizeof(ns_index::InvertedElem));
+        heaviest.append(term);
+    }
+
+    Json::Value postings;
+    postings["terms"] = (Json::UInt64)inverted.size();
+    postings["length"] = Distribution(lengths);
+    postings["heaviest_terms"] = heaviest;
+    return postings;
+}
+
+// cut every doc again, same as BuildInvertedIndex does, and count what stop words take away
+static Json::Value Tokens(ns_index::Index *index, int top_n)
+{
+    const std::vector<ns_index::DocInfo> &docs = index->GetForwardIndexAll();
+    const std::size_t batch_docs = 256; // docs cut per CutStringBatch, bounds the arena
+
+    std::vector<uint64_t> doc_tokens;
+    std::unordered_map<std::string, uint64_t> stop_hits;
+    uint64_t all_tokens = 0, stop_tokens = 0;
+    ns_util::TokenArena arena;
+    std::vector<const std::string *> srcs;
+    std::string token;
+    for(std::size_t begin = 0; begin < docs.size(); begin += batch_docs)
+    {
+        // title and content of every doc in the batch, stop words kept
+        std::size_t end = std::min(docs.size(), begin + batch_docs);
+        srcs.clear();
+        for(std::size_t i = begin; i < end; i++)
+        {
+            srcs.push_back(&docs[i].title);
+            srcs.push_back(&docs[i].content);
+        }
+        arena.Clear();
+        ns_util::JiebaUtil::CutStringBatch(srcs, &arena, false, true);
+
+        for(std::size_t i = begin; i < end; i++)
+        {
+            uint64_t kept = 0;
+            std::size_t field = (i - begin) * 2;
+            for(std::size_t t = arena.doc_offsets[field]; t < arena.doc_offsets[field + 2]; t++)
+            {
+                all_tokens++;
+                token.assign(arena.TokenData(t), arena.TokenSize(t));
+                if(ns_util::JiebaUtil::IsStopWord(token))
+                {
+                    stop_tokens++;
+                    stop_hits[token]++;
+                }
+                else
+                {
+                    kept++;
+                }
+            }
+            doc_tokens.push_back(kept);
+        }
+    }
+
+    std::vector<std::pair<uint64_t, std::string>> hits;
+    for(auto &pair : stop_hits)
+    {
+        hits.push_back(std::make_pair(pair.second, pair.first));
+    }
+    std::size_t n = std::min<std::size_t>(top_n, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + n, hits.end(),
+                      [](const std::pair<uint64_t, std::string> &a, const std::pair<uint64_t, std::string> &b)
+                      {
+                          return a.first > b.first;
+                      });
+    Json::Value top_stop_words(Json::arrayValue);
+    for(std::size_t i = 0; i < n; i++)
+    {
+        Json::Value word;
+        word["word"] = hits[i].second;
+        word["removed"] = (Json::UInt64)hits[i].first;
+        top_stop_words.append(word);
+    }
+
+    Json::Value stop_words;
+    stop_words["tokens_before"] = (Json::UInt64)all_tokens;
+    stop_words["tokens_removed"] = (Json::UInt64)stop_tokens;
+    stop_words["removed_ratio"] = all_tokens == 0 ? 0.0 : (double)stop_tokens / all_tokens;
+    stop_words["distinct_stop_words_hit"] = (Json::UInt64)stop_hits.size();
+    stop_words["top_stop_words"] = top_stop_words;
+
+    Json::Value tokens;
+    tokens["stop_words"] = stop_words;
+    tokens["tokens_per_doc"] = Distribution(doc_tokens);
+    return tokens;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string input = argc > 1 ? argv[1] : default_input;
+    int top_n = argc > 2 ? std::atoi(argv[2]) : default_top_n;
+    ns_index::DocOrder order = ns_index::ORDER_URL;
+    if((argc > 3 && !ns_index::Index::ParseDocOrder(argv[3], &order))
+       || (argc > 4 && std::string(argv[4]) != "nodedup"))
+    {
+        std::cerr << "usage: " << argv[0] << " [raw.txt] [top_n] [input|url|cluster] [nodedup]" << std::endl;
+        return 1;
+    }
+    bool dedup = argc <= 4;
+
+    // LOG writes to std::cout, keep stdout for json only
+    std::streambuf *cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+    ns_index::Index *index = ns_index::Index::GetInstance();
+    if(!index->BuildIndex(input, order, dedup))
+    {
+        std::cout.rdbuf(cout_buf);
+        return 1;
+    }
+
+    Json::Value root;
+    root["input"] = input;
+    root["dedup"] = dedup;
+    root["docs"] = (Json::UInt64)index->GetForwardIndexAll().size();
+    root["memory"] = Memory(index);
+    root["postings"] = Postings(index, top_n);
+    root["tokens"] = Tokens(index, top_n);
+    std::cout.rdbuf(cout_buf);
+
+    Json::StyledWriter writer;
+    std::cout << writer.write(root);
+    return 0;
+}
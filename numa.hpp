@@ -0,0 +1,211 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "util.hpp"
+#include "log.hpp"
+
+// memory placement of the index on multi-socket machines, no libnuma needed:
+// the kernel places a page on the node chosen by the memory policy of the thread that first touches it,
+// so setting the policy while building the index decides where postings, terms and docs live
+namespace ns_numa
+{
+
+    enum Placement
+    {
+        PLACE_LOCAL,        // first touch, everything on the node of the building thread
+        PLACE_INTERLEAVE,   // pages spread round-robin across all nodes
+        PLACE_REPLICATE     // one copy of the index on every node, serving threads pinned to their node
+    };
+
+    // linux/mempolicy.h
+    const int MPOL_DEFAULT_ = 0;
+    const int MPOL_PREFERRED_ = 1;
+    const int MPOL_INTERLEAVE_ = 3;
+    // asm-generic/mman-common.h, since linux 6.1
+    const int MADV_COLLAPSE_ = 25;
+
+    const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    const int MAX_NODES = 64;
+
+    class NumaUtil{
+        public:
+            // "local" / "interleave" / "replicate"
+            static bool ParsePlacement(const std::string &name, Placement *placement)
+            {
+                if(name == "local") *placement = PLACE_LOCAL;
+                else if(name == "interleave") *placement = PLACE_INTERLEAVE;
+                else if(name == "replicate") *placement = PLACE_REPLICATE;
+                else return false;
+                return true;
+            }
+
+            // online nodes, {0} when the kernel tells nothing
+            static std::vector<int> Nodes()
+            {
+                std::vector<int> nodes = ParseList(ReadSys("/sys/devices/system/node/online"));
+                if(nodes.empty())
+                {
+                    nodes.push_back(0);
+                }
+                return nodes;
+            }
+
+            static std::vector<int> NodeCpus(int node)
+            {
+                return ParseList(ReadSys("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+            }
+
+            // memory first touched by this thread from now on is spread across all nodes
+            static bool Interleave()
+            {
+                return SetPolicy(MPOL_INTERLEAVE_, Nodes());
+            }
+
+            // memory first touched by this thread from now on is on node while it has free memory,
+            // then on other nodes (a strict bind would get the process OOM-killed on a full node)
+            static bool Prefer(int node)
+            {
+                return SetPolicy(MPOL_PREFERRED_, std::vector<int>(1, node));
+            }
+
+            static bool ResetPolicy()
+            {
+                return SetPolicy(MPOL_DEFAULT_, std::vector<int>());
+            }
+
+            // node the calling thread is pinned to, -1 if not pinned
+            static int &CurrentNode()
+            {
+                static thread_local int node = -1;
+                return node;
+            }
+
+            // run the calling thread only on cpus of node
+            static bool Pin(int node)
+            {
+                std::vector<int> cpus = NodeCpus(node);
+                if(cpus.empty())
+                {
+                    return false;
+                }
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for(int cpu : cpus)
+                {
+                    CPU_SET(cpu, &set);
+                }
+                if(sched_setaffinity(0, sizeof(set), &set) != 0)
+                {
+                    LOG(WARNING, "pin thread to node " + std::to_string(node) + " error");
+                    return false;
+                }
+                CurrentNode() = node;
+                return true;
+            }
+
+            // ask for 2MB transparent huge pages on the memory of regions (see Index::MemoryRegions) and collapse
+            // them right now instead of waiting for khugepaged. only huge pages at least half filled by regions
+            // are advised, so thread stacks and other arenas next to the index are left alone
+            // returns bytes advised
+            static std::size_t AdviseHugePages(const std::vector<ns_util::MemoryRegion> &regions)
+            {
+                // 1.bytes of regions in every huge page
+                std::unordered_map<uintptr_t, std::size_t> covered;
+                for(const ns_util::MemoryRegion &region : regions)
+                {
+                    uintptr_t begin = (uintptr_t)region.first;
+                    uintptr_t end = begin + region.second;
+                    while(begin < end)
+                    {
+                        uintptr_t page = begin & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+                        uintptr_t page_end = std::min<uintptr_t>(end, page + HUGE_PAGE_SIZE);
+                        covered[page] += page_end - begin;
+                        begin = page_end;
+                    }
+                }
+
+                // 2.advise page by page, a run of pages may cross an unmapped hole and fail as a whole
+                std::size_t advised = 0;
+                for(auto &pair : covered)
+                {
+                    if(pair.second < HUGE_PAGE_SIZE / 2)
+                    {
+                        continue;
+                    }
+                    void *addr = (void *)pair.first;
+                    if(madvise(addr, HUGE_PAGE_SIZE, MADV_HUGEPAGE) == 0)
+                    {
+                        madvise(addr, HUGE_PAGE_SIZE, MADV_COLLAPSE_); // old kernels: khugepaged does it later
+                        advised += HUGE_PAGE_SIZE;
+                    }
+                }
+                LOG(NORMAL, "huge pages advised: " + std::to_string(advised) + " bytes");
+                return advised;
+            }
+
+        private:
+            // "0-3,8-11" -> 0 1 2 3 8 9 10 11
+            static std::vector<int> ParseList(const std::string &list)
+            {
+                std::vector<int> ids;
+                std::stringstream ss(list);
+                std::string range;
+                while(std::getline(ss, range, ','))
+                {
+                    int begin = 0, end = 0;
+                    int n = std::sscanf(range.c_str(), "%d-%d", &begin, &end);
+                    if(n < 1)
+                    {
+                        continue;
+                    }
+                    if(n == 1)
+                    {
+                        end = begin;
+                    }
+                    for(int id = begin; id <= end; id++)
+                    {
+                        ids.push_back(id);
+                    }
+                }
+                return ids;
+            }
+
+            static std::string ReadSys(const std::string &path)
+            {
+                std::ifstream in(path);
+                std::string line;
+                std::getline(in, line);
+                return line;
+            }
+
+            static bool SetPolicy(int mode, const std::vector<int> &nodes)
+            {
+                unsigned long mask = 0;
+                for(int node : nodes)
+                {
+                    if(node < MAX_NODES)
+                    {
+                        mask |= 1UL << node;
+                    }
+                }
+                long ret = syscall(SYS_set_mempolicy, mode, mode == MPOL_DEFAULT_ ? nullptr : &mask, mode == MPOL_DEFAULT_ ? 0 : MAX_NODES + 1);
+                if(ret != 0)
+                {
+                    LOG(WARNING, "set_mempolicy error, memory placement is left to the kernel");
+                    return false;
+                }
+                return true;
+            }
+    };
+}
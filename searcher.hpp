@@ -3,7 +3,9 @@
 #include "index.hpp"
 #include "util.hpp"
 #include "log.hpp"
+#include "numa.hpp"
 #include <algorithm>
+#include <thread>
 #include <unordered_map>
 #include <json/json.h>
 
@@ -15,7 +17,7 @@ namespace ns_searcher
     {
         uint64_t doc_id;
         int weight;
-        std::vector<std::string> words;
+        std::vector<uint32_t> term_ids; // words of the query found in this doc
         InvertedElemPrint():doc_id(0), weight(0){}
     };
 
@@ -23,59 +25,111 @@ namespace ns_searcher
     {
     private:
         ns_index::Index *index; // for program to search
+        std::vector<ns_index::Index *> replicas; // replicas[node], only for PLACE_REPLICATE
     public:
         Searcher() {}
         ~Searcher() {}
 
     public:
-        void InitSearcher(const std::string &input)
+        // order: how doc_ids are assigned, see ns_index::DocOrder
+        // placement: which NUMA nodes hold the index, see ns_numa::Placement
+        // huge_pages: back the index with 2MB transparent huge pages
+        // dedup: fold near-duplicate docs, see ns_index::Index::BuildIndex
+        void InitSearcher(const std::string &input, ns_index::DocOrder order = ns_index::ORDER_URL,
+                          ns_numa::Placement placement = ns_numa::PLACE_LOCAL, bool huge_pages = false, bool dedup = true)
         {
             // 1.get an Index instance
             index = ns_index::Index::GetInstance();
             // std::cout << "get index instance succeed" << std::endl;
             LOG(NORMAL, "get index instance success...");
-            // 2.build index by instance
-            index->BuildIndex(input);
+            // 2.build index by instance, pages are placed when they are first touched
+            std::vector<int> nodes = ns_numa::NumaUtil::Nodes();
+            if(placement == ns_numa::PLACE_INTERLEAVE)
+            {
+                ns_numa::NumaUtil::Interleave();
+            }
+            else if(placement == ns_numa::PLACE_REPLICATE)
+            {
+                ns_numa::NumaUtil::Prefer(nodes[0]);
+            }
+            index->BuildIndex(input, order, dedup);
+            if(placement != ns_numa::PLACE_LOCAL)
+            {
+                ns_numa::NumaUtil::ResetPolicy();
+            }
             // std::cout << "build forward_index and inverted_index succeed" << std::endl;
             LOG(NORMAL, "build forward and inverted index success...");
-        }
-
-        // query: key word for searching
-        // json_string: returns to user
-        void Search(const std::string &query, std::string *json_string)
-        {
-            // 1. cut query
-            std::vector<std::string> words;
-            ns_util::JiebaUtil::CutString(query, &words);
-
-            // 2.search words in inverted_index
-            // ns_index::InvertedList inverted_list_all;
-            std::vector<InvertedElemPrint> inverted_list_all;
-
-            std::unordered_map<uint64_t, InvertedElemPrint> tokens_map;     //remove duplicates
 
-            for (std::string word : words)
+            // 3.copy the index to the other nodes, each copy is touched by a thread preferring its node
+            if(placement == ns_numa::PLACE_REPLICATE)
             {
-                boost::to_lower(word);
-                ns_index::InvertedList *inverted_list = index->GetInvertedList(word);
-                if (nullptr == inverted_list)
+                replicas.assign(nodes.back() + 1, index);
+                std::vector<std::thread> threads;
+                for(std::size_t i = 1; i < nodes.size(); i++)
                 {
-                    continue;
+                    int node = nodes[i];
+                    threads.emplace_back([this, node](){
+                        ns_numa::NumaUtil::Prefer(node);
+                        replicas[node] = index->Replicate();
+                        ns_numa::NumaUtil::ResetPolicy();
+                    });
                 }
-                // inverted_list_all.insert(inverted_list_all.end(), inverted_list->begin(), inverted_list->end());
+                for(std::thread &t : threads)
+                {
+                    t.join();
+                }
+                LOG(NORMAL, "index replicated on " + std::to_string(nodes.size()) + " nodes...");
+            }
 
-                for(const auto &elem : *inverted_list)  //remove duplicates
+            if(huge_pages)
+            {
+                std::vector<ns_util::MemoryRegion> regions;
+                index->MemoryRegions(&regions);
+                for(std::size_t node = 0; node < replicas.size(); node++)
                 {
-                    auto &item = tokens_map[elem.doc_id];
-                    item.doc_id = elem.doc_id;
-                    item.weight += elem.weight;
-                    item.words.push_back(elem.word);
+                    if(replicas[node] != index)
+                    {
+                        replicas[node]->MemoryRegions(&regions);
+                    }
                 }
+                ns_numa::NumaUtil::AdviseHugePages(regions);
             }
-            for(const auto &item : tokens_map)
+        }
+
+        // replica on the node the calling thread is pinned to, or the only index
+        ns_index::Index *LocalIndex()
+        {
+            int node = ns_numa::NumaUtil::CurrentNode();
+            if(node >= 0 && (std::size_t)node < replicas.size())
             {
-                inverted_list_all.push_back(std::move(item.second));
+                return replicas[node];
             }
+            return index;
+        }
+
+        // query: key word for searching
+        // json_string: returns to user
+        void Search(const std::string &query, std::string *json_string)
+        {
+            Search(query, json_string, 0, true);
+        }
+
+        // candidates of query: docs holding any word of it, i.e. docs to weigh and sort before top_k is taken
+        std::size_t Candidates(const std::string &query)
+        {
+            std::vector<InvertedElemPrint> inverted_list_all;
+            Collect(query, LocalIndex(), &inverted_list_all);
+            return inverted_list_all.size();
+        }
+
+        // top_k: only return the top_k heaviest docs (0 means all of them)
+        // with_desc: build the snippet of each doc, skipped when server is overloaded
+        void Search(const std::string &query, std::string *json_string, size_t top_k, bool with_desc)
+        {
+            // 1.cut query and 2.search words in inverted_index
+            ns_index::Index *local_index = LocalIndex();
+            std::vector<InvertedElemPrint> inverted_list_all;
+            Collect(query, local_index, &inverted_list_all);
 
             // 3.sort by weight         
 
@@ -85,25 +139,34 @@ namespace ns_searcher
             //               return e1.weight > e2.weight;
             //           });
 
-            std::sort(inverted_list_all.begin(), inverted_list_all.end(),\
-                      [](const InvertedElemPrint &e1, const InvertedElemPrint &e2)
-                      {
-                          return e1.weight > e2.weight;
-                      });
+            auto cmp = [](const InvertedElemPrint &e1, const InvertedElemPrint &e2)
+                       {
+                           return e1.weight > e2.weight;
+                       };
+            if(top_k > 0 && top_k < inverted_list_all.size())
+            {
+                // only the first top_k are needed, no need to sort the whole list
+                std::partial_sort(inverted_list_all.begin(), inverted_list_all.begin() + top_k, inverted_list_all.end(), cmp);
+                inverted_list_all.resize(top_k);
+            }
+            else
+            {
+                std::sort(inverted_list_all.begin(), inverted_list_all.end(), cmp);
+            }
 
             // 4.construct Json string by jsoncpp-devel
             Json::Value root;
             Secret(&root);
             for (auto &item : inverted_list_all)
             {
-                ns_index::DocInfo *doc = index->GetForwardIndex(item.doc_id);
+                ns_index::DocInfo *doc = local_index->GetForwardIndex(item.doc_id);
                 if(nullptr == doc)
                 {
                     continue;
                 }
                 Json::Value elem;
                 elem["title"] = doc->title;
-                elem["desc"] = GetDesc(doc->content, item.words[0]); //part of whole content
+                elem["desc"] = with_desc ? GetDesc(doc->content, local_index->GetTerm(item.term_ids[0])) : ""; //part of whole content
                 elem["url"] = doc->url;
 
                 // for debug  for delete
@@ -119,6 +182,43 @@ namespace ns_searcher
             *json_string = writer.write(root);
         }
 
+    private:
+        // docs holding any word of query, with the summed weight and the words found in each
+        void Collect(const std::string &query, ns_index::Index *local_index, std::vector<InvertedElemPrint> *inverted_list_all)
+        {
+            // 1. cut query into term ids of the index (lower-cased like the index), words not in it are skipped
+            static thread_local std::vector<uint32_t> term_ids;
+            term_ids.clear();
+            ns_util::JiebaUtil::FindStringIds(query, local_index->GetTermsAll(), &term_ids, true);
+
+            // 2.search words in inverted_index
+            // ns_index::InvertedList inverted_list_all;
+            std::unordered_map<uint64_t, InvertedElemPrint> tokens_map;     //remove duplicates
+
+            for (uint32_t term_id : term_ids)
+            {
+                ns_index::InvertedList *inverted_list = local_index->GetInvertedList(term_id);
+                if (nullptr == inverted_list)
+                {
+                    continue;
+                }
+                // inverted_list_all.insert(inverted_list_all.end(), inverted_list->begin(), inverted_list->end());
+
+                for(const auto &elem : *inverted_list)  //remove duplicates
+                {
+                    auto &item = tokens_map[elem.doc_id];
+                    item.doc_id = elem.doc_id;
+                    item.weight += elem.weight;
+                    item.term_ids.push_back(elem.term_id);
+                }
+            }
+            for(const auto &item : tokens_map)
+            {
+                inverted_list_all->push_back(std::move(item.second));
+            }
+        }
+
+    public:
         std::string GetDesc(const std::string &html_content, const std::string &word)
         {
             // find first occur place of word, find 50 bytes before it (if not enough, from begin), 100 byte after it (if not enough, till end)
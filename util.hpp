@@ -7,6 +7,10 @@
 #include <boost/algorithm/string.hpp>
 #include <mutex>
 #include <unordered_set>
+#include <cstdint>
+#include <cctype>
+#include <cstring>
+#include <algorithm>
 #include "cppjieba/Jieba.hpp"
 #include "log.hpp"
 
@@ -41,39 +45,224 @@ namespace ns_util{
             }
     };
 
+    // start and size of a block of memory, see Index::MemoryRegions
+    typedef std::pair<const void *, std::size_t> MemoryRegion;
+
+    class HashUtil{
+        public:
+            // 64 bits FNV-1a
+            static uint64_t Fnv1a(const char *data, std::size_t len, uint64_t hash = 14695981039346656037ULL)
+            {
+                for(std::size_t i = 0; i < len; i++)
+                {
+                    hash ^= (unsigned char)data[i];
+                    hash *= 1099511628211ULL;
+                }
+                return hash;
+            }
+
+            // 64 bits SimHash of text, features are shingles of shingle_size words
+            // near-duplicate texts get hashes with small hamming distance
+            // shingles: number of shingles that voted, few of them make the hash meaningless
+            static uint64_t SimHash(const std::string &text, int shingle_size = 3, std::size_t *shingles_out = nullptr)
+            {
+                // 1.hash every word (split by ascii spaces and punctuations, utf8 bytes stay in word)
+                std::vector<uint64_t> words;
+                std::size_t begin = 0;
+                for(std::size_t i = 0; i <= text.size(); i++)
+                {
+                    if(i == text.size() || ((unsigned char)text[i] < 0x80 && !std::isalnum((unsigned char)text[i])))
+                    {
+                        if(i > begin)
+                        {
+                            words.push_back(Fnv1a(text.data() + begin, i - begin));
+                        }
+                        begin = i + 1;
+                    }
+                }
+
+                // 2.every shingle votes on 64 bits
+                int votes[64] = {0};
+                std::size_t shingles = words.size() < (std::size_t)shingle_size ? 1 : words.size() - shingle_size + 1;
+                for(std::size_t i = 0; i < shingles && !words.empty(); i++)
+                {
+                    uint64_t feature = 14695981039346656037ULL;
+                    for(std::size_t j = i; j < i + shingle_size && j < words.size(); j++)
+                    {
+                        feature = Fnv1a((const char *)&words[j], sizeof(uint64_t), feature);
+                    }
+                    for(int bit = 0; bit < 64; bit++)
+                    {
+                        votes[bit] += (feature >> bit) & 1 ? 1 : -1;
+                    }
+                }
+
+                if(shingles_out != nullptr)
+                {
+                    *shingles_out = words.empty() ? 0 : shingles;
+                }
+                uint64_t hash = 0;
+                for(int bit = 0; bit < 64; bit++)
+                {
+                    if(votes[bit] > 0)
+                    {
+                        hash |= 1ULL << bit;
+                    }
+                }
+                return hash;
+            }
+
+            static int HammingDistance(uint64_t a, uint64_t b)
+            {
+                int dist = 0;
+                for(uint64_t x = a ^ b; x; x &= x - 1)
+                {
+                    dist++;
+                }
+                return dist;
+            }
+    };
+
+    // tokens of many strings stored back to back in one buffer
+    // token i is chars[token_offsets[i], token_offsets[i+1]), tokens of src j are [doc_offsets[j], doc_offsets[j+1])
+    struct TokenArena{
+        std::string chars;
+        std::vector<std::size_t> token_offsets;
+        std::vector<std::size_t> doc_offsets;
+
+        TokenArena() { Clear(); }
+
+        // keep capacity, so a reused arena does not allocate
+        void Clear()
+        {
+            chars.clear();
+            token_offsets.assign(1, 0);
+            doc_offsets.assign(1, 0);
+        }
+
+        std::size_t TokenCount() const { return token_offsets.size() - 1; }
+        const char *TokenData(std::size_t i) const { return chars.data() + token_offsets[i]; }
+        std::size_t TokenSize(std::size_t i) const { return token_offsets[i + 1] - token_offsets[i]; }
+    };
+
+    // interns terms into dense ids [0, Size()), looked up by bytes, no std::string per lookup
+    class TermDict{
+        private:
+            std::string pool;               // all terms back to back
+            std::vector<uint32_t> offsets;  // term id is pool[offsets[id], offsets[id+1])
+            std::vector<uint32_t> slots;    // open addressing table of id + 1, 0 is empty
+
+        public:
+            static const uint32_t NOT_FOUND = 0xffffffff;
+
+            TermDict() { Clear(); }
+
+            void Clear()
+            {
+                pool.clear();
+                offsets.assign(1, 0);
+                slots.assign(64, 0);
+            }
+
+            std::size_t Size() const { return offsets.size() - 1; }
+            const char *Data(uint32_t id) const { return pool.data() + offsets[id]; }
+            std::size_t Length(uint32_t id) const { return offsets[id + 1] - offsets[id]; }
+            std::string Term(uint32_t id) const { return std::string(Data(id), Length(id)); }
+            // bytes held by term text, and by offsets + hash table
+            std::size_t PoolBytes() const { return pool.capacity(); }
+            std::size_t TableBytes() const { return (offsets.capacity() + slots.capacity()) * sizeof(uint32_t); }
+
+            void MemoryRegions(std::vector<MemoryRegion> *regions) const
+            {
+                regions->push_back(MemoryRegion(pool.data(), pool.capacity()));
+                regions->push_back(MemoryRegion(offsets.data(), offsets.capacity() * sizeof(uint32_t)));
+                regions->push_back(MemoryRegion(slots.data(), slots.capacity() * sizeof(uint32_t)));
+            }
+
+            uint32_t Find(const char *data, std::size_t len) const
+            {
+                std::size_t slot = Probe(data, len, slots);
+                return slots[slot] == 0 ? (uint32_t)NOT_FOUND : slots[slot] - 1;
+            }
+
+            uint32_t Intern(const char *data, std::size_t len)
+            {
+                std::size_t slot = Probe(data, len, slots);
+                if(slots[slot] != 0)
+                {
+                    return slots[slot] - 1;
+                }
+                if(pool.size() + len > 0xffffffffULL || Size() + 1 >= NOT_FOUND)
+                {
+                    LOG(FATAL, "TermDict is full, term dropped");
+                    return NOT_FOUND;
+                }
+
+                uint32_t id = Size();
+                pool.append(data, len);
+                offsets.push_back(pool.size());
+                slots[slot] = id + 1;
+                if(Size() * 2 > slots.size())
+                {
+                    Grow(); // keep load factor under 0.5
+                }
+                return id;
+            }
+
+        private:
+            std::size_t Probe(const char *data, std::size_t len, const std::vector<uint32_t> &table) const
+            {
+                std::size_t mask = table.size() - 1;
+                std::size_t slot = HashUtil::Fnv1a(data, len) & mask;
+                while(table[slot] != 0)
+                {
+                    uint32_t id = table[slot] - 1;
+                    if(Length(id) == len && std::memcmp(Data(id), data, len) == 0)
+                    {
+                        break;
+                    }
+                    slot = (slot + 1) & mask;
+                }
+                return slot;
+            }
+
+            void Grow()
+            {
+                std::vector<uint32_t> table(slots.size() * 2, 0);
+                for(uint32_t id = 0; id < Size(); id++)
+                {
+                    table[Probe(Data(id), Length(id), table)] = id + 1;
+                }
+                slots.swap(table);
+            }
+    };
+
     const char* const DICT_PATH = "./dict/jieba.dict.utf8";
     const char* const HMM_PATH = "./dict/hmm_model.utf8";
     const char* const USER_DICT_PATH = "./dict/user.dict.utf8";
     const char* const IDF_PATH = "./dict/idf.utf8";
     const char* const STOP_WORD_PATH = "./dict/stop_words.utf8";
 
+    // jieba and stop_words are read only after construction, so every Cut* can run on many threads at once,
+    // each thread keeps its own scratch buffer for jieba's output
     class JiebaUtil{
         private:
             cppjieba::Jieba jieba;
             std::unordered_set<std::string> stop_words;
-            static JiebaUtil *instance;
 
         private:
             JiebaUtil():jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH)
-            {}
+            {
+                InitJiebaUtil();
+            }
             JiebaUtil(const JiebaUtil&) = delete;
 
         public:
             static JiebaUtil* GetInstance()
             {
-                static std::mutex mtx;
-                if(nullptr == instance)
-                {
-                    mtx.lock();
-                    if(nullptr == instance)
-                    {
-                        instance = new JiebaUtil();
-                        instance->InitJiebaUtil();
-                    }
-                    mtx.unlock();
-                }
-
-                return instance;
+                // initialization of local static is thread safe since c++11
+                static JiebaUtil instance;
+                return &instance;
             }
 
             void InitJiebaUtil()
@@ -94,20 +283,115 @@ namespace ns_util{
                 in.close();
             }
 
-            void CutStringHelper(const std::string &src, std::vector<std::string> *out)
+            // per thread output of jieba, reused so its strings keep their buffers between calls
+            // (only the words before the count returned by CutKeptHelper are valid; jieba still allocates while cutting)
+            static std::vector<std::string> &Scratch()
+            {
+                static thread_local std::vector<std::string> words;
+                return words;
+            }
+
+            static void ToLower(char *data, std::size_t len)
+            {
+                for(std::size_t i = 0; i < len; i++)
+                {
+                    if(data[i] >= 'A' && data[i] <= 'Z')
+                    {
+                        data[i] += 'a' - 'A';
+                    }
+                }
+            }
+
+            // cut src into words and move stop words behind the returned count in one pass,
+            // they are not erased so their strings are reused by the next call
+            std::size_t CutKeptHelper(const std::string &src, std::vector<std::string> *words) const
+            {
+                jieba.CutForSearch(src, *words);
+                auto end = std::remove_if(words->begin(), words->end(), [this](const std::string &word){
+                    return stop_words.find(word) != stop_words.end();
+                });
+                return end - words->begin();
+            }
+
+            void CutStringHelper(const std::string &src, std::vector<std::string> *out) const
+            {
+                out->erase(out->begin() + CutKeptHelper(src, out), out->end());
+            }
+
+            void CutStringAllHelper(const std::string &src, std::vector<std::string> *out) const
             {
                 jieba.CutForSearch(src, *out);
-                for(auto iter = out->begin(); iter != out->end(); )
+            }
+
+            bool IsStopWordHelper(const std::string &word) const
+            {
+                return stop_words.find(word) != stop_words.end();
+            }
+
+            void CutStringBatchHelper(const std::vector<const std::string *> &srcs, TokenArena *arena, bool lower, bool keep_stop_words) const
+            {
+                std::vector<std::string> &words = Scratch();
+                for(const std::string *src : srcs)
                 {
-                    auto it = stop_words.find(*iter);
-                    if(it != stop_words.end())
+                    std::size_t count = 0;
+                    if(keep_stop_words)
                     {
-                        // means the *iter now is a stop word
-                        iter = out->erase(iter);
+                        CutStringAllHelper(*src, &words);
+                        count = words.size();
                     }
                     else
                     {
-                        iter++;
+                        count = CutKeptHelper(*src, &words);
+                    }
+                    for(std::size_t i = 0; i < count; i++)
+                    {
+                        const std::string &word = words[i];
+                        std::size_t begin = arena->chars.size();
+                        arena->chars += word;
+                        if(lower)
+                        {
+                            ToLower(&arena->chars[begin], word.size());
+                        }
+                        arena->token_offsets.push_back(arena->chars.size());
+                    }
+                    arena->doc_offsets.push_back(arena->TokenCount());
+                }
+            }
+
+            void CutStringToIdsHelper(const std::string &src, TermDict *dict, std::vector<uint32_t> *ids, bool lower) const
+            {
+                std::vector<std::string> &words = Scratch();
+                std::size_t count = CutKeptHelper(src, &words);
+                for(std::size_t i = 0; i < count; i++)
+                {
+                    std::string &word = words[i];
+                    if(lower)
+                    {
+                        ToLower(&word[0], word.size());
+                    }
+                    uint32_t id = dict->Intern(word.data(), word.size());
+                    if(id != TermDict::NOT_FOUND)
+                    {
+                        ids->push_back(id);
+                    }
+                }
+            }
+
+            void FindStringIdsHelper(const std::string &src, const TermDict &dict, std::vector<uint32_t> *ids, bool lower) const
+            {
+                std::vector<std::string> &words = Scratch();
+                std::size_t count = CutKeptHelper(src, &words);
+                for(std::size_t i = 0; i < count; i++)
+                {
+                    std::string &word = words[i];
+                    if(lower)
+                    {
+                        ToLower(&word[0], word.size());
+                    }
+                    uint32_t id = dict.Find(word.data(), word.size());
+                    if(id != TermDict::NOT_FOUND)
+                    {
+                        ids->push_back(id);
                     }
                 }
             }
@@ -117,6 +401,38 @@ namespace ns_util{
             {
                 ns_util::JiebaUtil::GetInstance()->CutStringHelper(src, out);
             }
+
+            // keep stop words, for statistics
+            static void CutStringAll(const std::string &src, std::vector<std::string> *out)
+            {
+                ns_util::JiebaUtil::GetInstance()->CutStringAllHelper(src, out);
+            }
+
+            static bool IsStopWord(const std::string &word)
+            {
+                return ns_util::JiebaUtil::GetInstance()->IsStopWordHelper(word);
+            }
+
+            // cut every src and append its tokens to arena, one doc_offsets entry per src
+            // lower: lower-case ascii letters of tokens, like boost::to_lower in the "C" locale
+            // keep_stop_words: like CutStringAll, otherwise like CutString
+            static void CutStringBatch(const std::vector<const std::string *> &srcs, TokenArena *arena,
+                                       bool lower = false, bool keep_stop_words = false)
+            {
+                ns_util::JiebaUtil::GetInstance()->CutStringBatchHelper(srcs, arena, lower, keep_stop_words);
+            }
+
+            // cut src and append term ids of its tokens (stop words removed) to ids
+            static void CutStringToIds(const std::string &src, TermDict *dict, std::vector<uint32_t> *ids, bool lower = false)
+            {
+                ns_util::JiebaUtil::GetInstance()->CutStringToIdsHelper(src, dict, ids, lower);
+            }
+
+            // like CutStringToIds, but only looks tokens up: unknown ones are skipped and dict is not changed,
+            // so many threads can use one dict, e.g. queries against the index's terms
+            static void FindStringIds(const std::string &src, const TermDict &dict, std::vector<uint32_t> *ids, bool lower = false)
+            {
+                ns_util::JiebaUtil::GetInstance()->FindStringIdsHelper(src, dict, ids, lower);
+            }
     };
-    JiebaUtil* JiebaUtil::instance = nullptr;
-}
\ No newline at end of file
+}